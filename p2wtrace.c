@@ -0,0 +1,107 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+/**
+ * Decode posix2wx -t trace dump to text or CSV
+ */
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <wchar.h>
+#include <errno.h>
+
+#include "posix2wx.h"
+
+static const char *branches[] = {
+    "none",
+    "notposix",
+    "winpath",
+    "cygdrive",
+    "msysdrive",
+    "foreign",
+    "dotpath",
+    "root",
+    "devnull",
+    "prefix",
+    "cached",
+    0
+};
+
+static int usage(int rv)
+{
+    FILE *os = rv == 0 ? stdout : stderr;
+    fputs("\nUsage p2wtrace [-c] FILE\n", os);
+    fputs("Decode " PROJECT_NAME " trace FILE\n\nOptions are:\n", os);
+    fputs(" -c        print records as CSV\n\n", os);
+    return rv;
+}
+
+static const char *branchname(int b)
+{
+    if (b < 0 || b > P2W_BRANCH_CACHED)
+        return "unknown";
+    else
+        return branches[b];
+}
+
+int wmain(int argc, const wchar_t **wargv)
+{
+    FILE *fp;
+    p2wtrace_hdr_t h;
+    p2wtrace_rec_t r;
+    unsigned int   i;
+    double ns;
+    double total = 0.0;
+    int csv = 0;
+    const wchar_t *fn;
+
+    if (argc == 3 && _wcsicmp(wargv[1], L"-c") == 0)
+        csv = 1;
+    else if (argc != 2)
+        return usage(1);
+    fn = wargv[argc - 1];
+    if ((fp = _wfopen(fn, L"rb")) == 0) {
+        _wperror(fn);
+        return errno;
+    }
+    if (fread(&h, sizeof(h), 1, fp) != 1 ||
+        h.magic != P2W_TRACE_MAGIC || h.version != P2W_TRACE_VERSION) {
+        fwprintf(stderr, L"Invalid trace file: %s\n", fn);
+        fclose(fp);
+        return EINVAL;
+    }
+    if (h.frequency == 0)
+        h.frequency = 1;
+    if (csv)
+        fputs("seq,source,item,offset,token,match,branch,length,ns\n", stdout);
+    else
+        printf("Records: %u, dropped: %u\n\n", h.count, h.dropped);
+    for (i = 0; i < h.count; i++) {
+        if (fread(&r, sizeof(r), 1, fp) != 1) {
+            fwprintf(stderr, L"Truncated trace file: %s\n", fn);
+            break;
+        }
+        ns = (double)r.ticks * 1.0e9 / (double)h.frequency;
+        total += ns;
+        printf(csv ? "%u,%c,%u,%u,%u,%u,%s,%u,%.0f\n"
+                   : "[%4u] %c %4u +%-4u #%-3u %3u %-9s %5u %10.0f ns\n",
+               i + h.dropped, r.source, r.item, r.offset, r.token,
+               r.match, branchname(r.branch), r.length, ns);
+    }
+    if (!csv)
+        printf("\nTotal: %.0f ns\n", total);
+    fclose(fp);
+    return 0;
+}
@@ -22,11 +22,54 @@
 #include <process.h>
 #include <fcntl.h>
 #include <io.h>
+#include <psapi.h>
 
 #include "posix2wx.h"
 
 #define IS_PSW(c)         ((c) == L'/' || (c) == L'\\')
 #define IS_EMPTY_WCS(_s)  ((_s == 0)   || (*(_s) == L'\0'))
+#define IS_TOKSEP(c)      ((c) == ' ' || (c) == '\t' || (c) == '\r' || (c) == '\n' || (c) == '"')
+
+/**
+ * File rewrite mode splits input files larger
+ * than P2W_CHUNK_SIZE into per-cpu chunks
+ */
+#define P2W_CHUNK_SIZE    (64 * 1024)
+#define P2W_TOKEN_SIZE    2048
+
+/**
+ * Symbolic link resolution
+ */
+#define P2W_LINK_CACHE    64
+#define P2W_LINK_LOOPS    8
+#define P2W_LINK_SIZE     4096
+
+#if !defined(IO_REPARSE_TAG_LX_SYMLINK)
+# define IO_REPARSE_TAG_LX_SYMLINK  0xA000001DL
+#endif
+
+/**
+ * Shared conversion cache.
+ * The name must change whenever cacheslot_t layout changes.
+ */
+#define P2W_CACHE_NAME    L"Local\\posix2wx-cache-3"
+#if !defined(P2W_CACHE_SIZE)
+#define P2W_CACHE_SIZE    (4 * 1024 * 1024)
+#endif
+#define P2W_CACHE_SLOT    1024
+#define P2W_CACHE_PROBE   8
+/**
+ * Slot claimed by a writer more than P2W_CACHE_STALE
+ * insertions ago is treated as abandoned by a killed
+ * process and can be reclaimed. A preempted writer can
+ * still overwrite the reclaimed slot, so readers verify
+ * the slot check sum after copying the value.
+ */
+#define P2W_CACHE_STALE   (P2W_CACHE_SIZE / P2W_CACHE_SLOT)
+#define SLOT_SEQ(s)       ((LONG)((s) & 0xFFFFFFFF))
+#define SLOT_STAMP(s)     ((LONG)((s) >> 32))
+#define SLOT_STATE(q, t)  (((LONGLONG)(t) << 32) | (ULONG)(q))
+#define P2W_CACHE_CHARS   ((P2W_CACHE_SLOT - 32) / sizeof(wchar_t))
 
 #if defined(_TEST_MODE)
 #undef _HAVE_DEBUG_OPTION
@@ -34,9 +77,56 @@
 
 #if defined(_HAVE_DEBUG_OPTION)
 static int      debug     = 0;
+static volatile LONG xallocs = 0;
 #endif
 static int      execmode  = _P_WAIT;
 static wchar_t *posixroot = 0;
+static wchar_t *tracefile = 0;
+static wchar_t *usagefile = 0;
+static LONGLONG starttime = 0;
+
+static volatile LONG  tracepos = 0;
+static __declspec(thread) p2wtrace_rec_t tracectx;
+static p2wtrace_rec_t tracebuf[P2W_TRACE_SIZE];
+
+typedef struct cachehdr_t {
+    volatile LONG     clock;
+    volatile LONG     hits;
+    volatile LONG     misses;
+    LONG              reserved[13];
+} cachehdr_t;
+
+/**
+ * Slot state holds the sequence in the low and the
+ * insertion stamp in the high 32 bits, so that both
+ * are updated together.
+ * Slot is valid when seq is even and non zero.
+ * Writers make seq odd while updating the slot
+ * and readers retry if seq changed while reading.
+ */
+typedef struct cacheslot_t {
+    volatile LONGLONG state;
+    unsigned __int64  hash;
+    unsigned __int64  check;    /* Hash of key and value data */
+    unsigned short    klen;
+    unsigned short    vlen;
+    unsigned int      reserved;
+    wchar_t           data[P2W_CACHE_CHARS];
+} cacheslot_t;
+
+static cachehdr_t      *cachemap   = 0;
+static cacheslot_t     *cacheslots = 0;
+static size_t           cachesize  = 0;
+static unsigned __int64 cacheseed  = 0;
+
+typedef struct linkent_t {
+    wchar_t          *path;
+    wchar_t          *target;   /* Zero if path is not a link */
+} linkent_t;
+
+static int      resolvelinks = 0;
+static __declspec(thread) int       linknext = 0;
+static __declspec(thread) linkent_t linkcache[P2W_LINK_CACHE];
 
 static const wchar_t *pathmatches[] = {
     L"/cygdrive/?/*",
@@ -113,6 +203,11 @@ static int usage(int rv)
     fputs("\nUsage " PROJECT_NAME " [OPTIONS]... PROGRAM [ARGUMENTS]...\n", os);
     fputs("Execute PROGRAM [ARGUMENTS]...\n\nOptions are:\n", os);
     fputs(" -a        Use async execution mode.\n", os);
+    fputs(" -c        use conversion cache shared between processes.\n", os);
+    fputs(" -e <FILE> use environment snapshot from FILE instead of\n", os);
+    fputs("           current environment.\n", os);
+    fputs(" -f <FILE> convert paths inside FILE, write the result to\n", os);
+    fputs("           standard output and exit.\n", os);
 #if defined(_HAVE_DEBUG_OPTION)
     fputs(" -d        print replaced arguments and environment\n", os);
     fputs("           instead executing PROGRAM.\n", os);
@@ -120,7 +215,12 @@ static int usage(int rv)
     fputs(" -v        print version information and exit.\n", os);
     fputs(" -h        print this screen and exit.\n", os);
     fputs(" -w <DIR>  change working directory to DIR before calling PROGRAM\n", os);
-    fputs(" -r <DIR>  use DIR as posix root\n\n", os);
+    fputs(" -m        merge -e FILE with current environment.\n", os);
+    fputs(" -r <DIR>  use DIR as posix root\n", os);
+    fputs(" -s        resolve symbolic links under posix root\n", os);
+    fputs(" -t <FILE> write conversion trace to FILE on exit\n", os);
+    fputs(" -u <FILE> append PROGRAM resource usage to FILE in JSON\n", os);
+    fputs("           format or write it to stderr if FILE is -\n\n", os);
     return rv;
 }
 
@@ -140,6 +240,9 @@ static int invalidarg(const wchar_t *arg)
 static void *xmalloc(size_t size)
 {
     void *p = calloc(size, 1);
+#if defined(_HAVE_DEBUG_OPTION)
+    InterlockedIncrement(&xallocs);
+#endif
     if (p == 0) {
         _wperror(L"xmalloc");
         _exit(1);
@@ -150,6 +253,9 @@ static void *xmalloc(size_t size)
 static wchar_t *xwalloc(size_t size)
 {
     wchar_t *p = (wchar_t *)calloc(size, sizeof(wchar_t));
+#if defined(_HAVE_DEBUG_OPTION)
+    InterlockedIncrement(&xallocs);
+#endif
     if (p == 0) {
         _wperror(L"xwalloc");
         _exit(1);
@@ -157,6 +263,19 @@ static wchar_t *xwalloc(size_t size)
     return p;
 }
 
+static void *xrealloc(void *m, size_t size)
+{
+    void *p = realloc(m, size);
+#if defined(_HAVE_DEBUG_OPTION)
+    InterlockedIncrement(&xallocs);
+#endif
+    if (p == 0) {
+        _wperror(L"xrealloc");
+        _exit(1);
+    }
+    return p;
+}
+
 static wchar_t **waalloc(size_t size)
 {
     return (wchar_t **)xmalloc((size + 1) * sizeof(wchar_t *));
@@ -234,6 +353,21 @@ static wchar_t *xwcsconcat(const wchar_t *s1, const wchar_t *s2)
     return rv;
 }
 
+static wchar_t *xwcsnconcat(const wchar_t *s1, size_t l1, const wchar_t *s2)
+{
+    wchar_t *rv;
+    size_t l2 = xwcslen(s2);
+
+    if ((l1 + l2) == 0)
+        return 0;
+    rv = xwalloc(l1 + l2 + 2);
+    if (l1 > 0)
+        wmemcpy(rv, s1, l1);
+    if (l2 > 0)
+        wmemcpy(rv + l1, s2, l2);
+    return rv;
+}
+
 /**
  * Match = 0, NoMatch = 1, Abort = -1
  * Based loosely on sections of wildmat.c by Rich Salz
@@ -272,6 +406,65 @@ static int xwcsmatch(const wchar_t *wstr, const wchar_t *wexp)
     return (*wstr != L'\0');
 }
 
+static LONGLONG traceticks(void)
+{
+    LARGE_INTEGER c;
+
+    QueryPerformanceCounter(&c);
+    return c.QuadPart;
+}
+
+/**
+ * Set the origin of the next trace records
+ */
+static void tracesource(int source, int item, int offset)
+{
+    tracectx.source = (unsigned char)source;
+    tracectx.item   = (unsigned short)item;
+    tracectx.offset = (unsigned int)offset;
+    tracectx.token  = 0;
+}
+
+/**
+ * Add trace record to the ring buffer.
+ * When the buffer wraps the oldest records are overwritten.
+ */
+static void traceadd(int match, int branch, const wchar_t *s, LONGLONG ticks)
+{
+    LONG n = InterlockedIncrement(&tracepos) - 1;
+    p2wtrace_rec_t *r = &tracebuf[n & (P2W_TRACE_SIZE - 1)];
+
+    *r = tracectx;
+    r->match  = (unsigned short)match;
+    r->branch = (unsigned char)branch;
+    r->length = (unsigned short)xwcslen(s);
+    r->ticks  = (unsigned int)ticks;
+}
+
+static void tracedump(void)
+{
+    FILE *fp;
+    LARGE_INTEGER  f;
+    p2wtrace_hdr_t h;
+    unsigned int   i;
+    unsigned int   n = (unsigned int)tracepos;
+
+    if ((fp = _wfopen(tracefile, L"wb")) == 0) {
+        _wperror(tracefile);
+        return;
+    }
+    QueryPerformanceFrequency(&f);
+    h.magic     = P2W_TRACE_MAGIC;
+    h.version   = P2W_TRACE_VERSION;
+    h.count     = n > P2W_TRACE_SIZE ? P2W_TRACE_SIZE : n;
+    h.dropped   = n - h.count;
+    h.frequency = f.QuadPart;
+    fwrite(&h, sizeof(h), 1, fp);
+    for (i = n - h.count; i < n; i++)
+        fwrite(&tracebuf[i & (P2W_TRACE_SIZE - 1)], sizeof(p2wtrace_rec_t), 1, fp);
+    fclose(fp);
+}
+
 static int strstartswith(const wchar_t *str, const wchar_t *src)
 {
     while (*str != L'\0') {
@@ -349,7 +542,7 @@ static int isposixpath(const wchar_t *str)
  * convert value part to Windows paths unless the
  * name part itself is a path
  */
-static wchar_t *cmdoptionval(wchar_t *s)
+static const wchar_t *cmdoptionval(const wchar_t *s)
 {
     if (iswinpath(s) || isposixpath(s))
         return 0;
@@ -362,9 +555,98 @@ static wchar_t *cmdoptionval(wchar_t *s)
     return 0;
 }
 
-static int envsort(const void *arg1, const void *arg2)
+typedef struct envkey_t {
+    unsigned __int64  prefix;   /* First four folded characters */
+    const wchar_t    *key;      /* Uppercase folded name */
+    int               len;
+    wchar_t          *var;
+} envkey_t;
+
+/**
+ * Ordinal compare of folded environment names
+ */
+static int envkeycmp(const envkey_t *a, const envkey_t *b)
 {
-    return _wcsicoll(*((wchar_t **)arg1), *((wchar_t **)arg2));
+    int n;
+
+    if (a->prefix != b->prefix)
+        return a->prefix < b->prefix ? -1 : 1;
+    n = a->len < b->len ? a->len : b->len;
+    if (n > 4 && (n = wmemcmp(a->key + 4, b->key + 4, n - 4)) != 0)
+        return n;
+    return a->len - b->len;
+}
+
+/**
+ * Sort environment by names the way CreateProcess expects.
+ * Names are case folded once using invariant uppercase
+ * mapping and then merge sorted by ordinal value.
+ */
+static void envsort(wchar_t **envp, int envc)
+{
+    int i, n, w;
+    size_t len = 0;
+    wchar_t  *names;
+    envkey_t *a, *b, *t;
+
+    if (envc < 2)
+        return;
+    for (i = 0; i < envc; i++) {
+        /* Name can start with '=' eg. =C:=C:\ */
+        wchar_t *e = wcschr(envp[i] + 1, L'=');
+        len += e == 0 ? wcslen(envp[i]) : (size_t)(e - envp[i]);
+    }
+    names = xwalloc(len + 1);
+    a = (envkey_t *)xmalloc(envc * sizeof(envkey_t) * 2);
+    b = a + envc;
+    for (i = 0, len = 0; i < envc; i++) {
+        wchar_t *e = wcschr(envp[i] + 1, L'=');
+        n = e == 0 ? (int)wcslen(envp[i]) : (int)(e - envp[i]);
+        wmemcpy(names + len, envp[i], n);
+        a[i].key = names + len;
+        a[i].len = n;
+        a[i].var = envp[i];
+        len += n;
+    }
+    LCMapStringW(LOCALE_INVARIANT, LCMAP_UPPERCASE, names, (int)len, names, (int)len);
+    for (i = 0; i < envc; i++) {
+        a[i].prefix = 0;
+        for (n = 0; n < 4; n++) {
+            a[i].prefix <<= 16;
+            if (n < a[i].len)
+                a[i].prefix |= (unsigned short)a[i].key[n];
+        }
+    }
+    /**
+     * Bottom-up merge sort
+     */
+    for (w = 1; w < envc; w *= 2) {
+        for (i = 0; i < envc; i += 2 * w) {
+            int l = i;
+            int m = i + w < envc ? i + w : envc;
+            int r = m;
+            int x = i + 2 * w < envc ? i + 2 * w : envc;
+
+            n = i;
+            while (l < m && r < x) {
+                if (envkeycmp(&a[r], &a[l]) < 0)
+                    b[n++] = a[r++];
+                else
+                    b[n++] = a[l++];
+            }
+            while (l < m)
+                b[n++] = a[l++];
+            while (r < x)
+                b[n++] = a[r++];
+        }
+        t = a;
+        a = b;
+        b = t;
+    }
+    for (i = 0; i < envc; i++)
+        envp[i] = a[i].var;
+    xfree(a < b ? a : b);
+    xfree(names);
 }
 
 static void xwinpathsep(wchar_t *s)
@@ -472,9 +754,8 @@ static void rmtrailingsep(wchar_t *s)
     }
 }
 
-static wchar_t *posix2win(wchar_t *pp)
+static wchar_t *xposix2win(wchar_t *pp, int *m, int *b)
 {
-    int m;
     wchar_t *rv;
     wchar_t  windrive[] = { 0, L':', L'\\', 0};
 
@@ -483,38 +764,48 @@ static wchar_t *posix2win(wchar_t *pp)
     /**
      * Check for special paths
      */
-    m = isposixpath(pp);
-    if (m == 0) {
+    *m = isposixpath(pp);
+    if (*m == 0) {
         /* Not a posix path */
-        if (iswinpath(pp))
+        *b = P2W_BRANCH_NOTPOSIX;
+        if (iswinpath(pp)) {
+            *b = P2W_BRANCH_WINPATH;
             xwinpathsep(pp);
+        }
         return pp;
     }
-    else if (m == 100) {
+    else if (*m == 100) {
         /* /cygdrive/x/... absolute path */
+        *b = P2W_BRANCH_CYGDRIVE;
         windrive[0] = towupper(pp[10]);
         rv = xwcsconcat(windrive, pp + 12);
         xwinpathsep(rv + 3);
     }
-    else if (m == 101) {
+    else if (*m == 101) {
         /* /x/... msys2 absolute path */
+        *b = P2W_BRANCH_FOREIGN;
         windrive[0] = towupper(pp[1]);
         if (windrive[0] != *posixroot)
             return pp;
+        *b = P2W_BRANCH_MSYSDRIVE;
         rv = xwcsconcat(windrive, pp + 3);
         xwinpathsep(rv + 3);
     }
-    else if (m == 300) {
+    else if (*m == 300) {
+        *b = P2W_BRANCH_DOTPATH;
         xwinpathsep(pp);
         return pp;
     }
-    else if (m == 301) {
+    else if (*m == 301) {
+        *b = P2W_BRANCH_ROOT;
         rv = xwcsdup(posixroot);
     }
-    else if (m == 302) {
+    else if (*m == 302) {
+        *b = P2W_BRANCH_DEVNULL;
         rv = xwcsdup(L"NUL");
     }
     else {
+        *b = P2W_BRANCH_PREFIX;
         xwinpathsep(pp);
         rv = xwcsconcat(posixroot, pp);
     }
@@ -522,6 +813,374 @@ static wchar_t *posix2win(wchar_t *pp)
     return rv;
 }
 
+/**
+ * Read WSL symlink reparse point.
+ * The reparse data starts with the tag, data length
+ * and reserved word followed by the format version
+ * and UTF-8 target without terminating zero.
+ */
+static wchar_t *readlxlink(const wchar_t *path)
+{
+    HANDLE   fh;
+    DWORD    n = 0;
+    DWORD    tag;
+    int      sn, wn;
+    wchar_t *t;
+    unsigned char b[P2W_LINK_SIZE + 12];
+
+    fh = CreateFileW(path, 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                     0, OPEN_EXISTING,
+                     FILE_FLAG_OPEN_REPARSE_POINT | FILE_FLAG_BACKUP_SEMANTICS, 0);
+    if (fh == INVALID_HANDLE_VALUE)
+        return 0;
+    if (!DeviceIoControl(fh, FSCTL_GET_REPARSE_POINT, 0, 0, b, sizeof(b), &n, 0))
+        n = 0;
+    CloseHandle(fh);
+    if (n < 12)
+        return 0;
+    tag = b[0] | (b[1] << 8) | (b[2] << 16) | ((DWORD)b[3] << 24);
+    /* Data length includes the version */
+    sn = (b[4] | (b[5] << 8)) - 4;
+    if ((tag != IO_REPARSE_TAG_LX_SYMLINK) || (sn < 1) || ((DWORD)sn > n - 12))
+        return 0;
+    wn = MultiByteToWideChar(CP_UTF8, 0, (const char *)b + 12, sn, 0, 0);
+    if (wn == 0)
+        return 0;
+    t = xwalloc(wn + 1);
+    MultiByteToWideChar(CP_UTF8, 0, (const char *)b + 12, sn, t, wn);
+    t[wn] = L'\0';
+    return t;
+}
+
+/**
+ * Read Cygwin symlink file or WSL symlink.
+ * Returns the link target in posix form or zero
+ * if the path is not a symlink.
+ */
+static wchar_t *readlinkfile(const wchar_t *path)
+{
+    HANDLE   fh;
+    DWORD    a;
+    DWORD    n = 0;
+    wchar_t *t;
+    unsigned char b[P2W_LINK_SIZE + 2];
+
+    a = GetFileAttributesW(path);
+    if (a == INVALID_FILE_ATTRIBUTES)
+        return 0;
+    if (a & FILE_ATTRIBUTE_REPARSE_POINT) {
+        /**
+         * Native Windows symlinks are followed by the
+         * system, only WSL symlinks need resolving
+         */
+        return readlxlink(path);
+    }
+    if ((a & FILE_ATTRIBUTE_DIRECTORY) || !(a & FILE_ATTRIBUTE_SYSTEM))
+        return 0;
+    fh = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                     0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+    if (fh == INVALID_HANDLE_VALUE)
+        return 0;
+    if (!ReadFile(fh, b, P2W_LINK_SIZE, &n, 0))
+        n = 0;
+    CloseHandle(fh);
+    if ((n < 12) || (memcmp(b, "!<symlink>", 10) != 0))
+        return 0;
+    b[n] = b[n + 1] = 0;
+    if (b[10] == 0xFF && b[11] == 0xFE) {
+        /* UTF-16LE target */
+        DWORD i;
+        t = xwalloc((n - 12) / 2 + 1);
+        for (i = 0; i < (n - 12) / 2; i++)
+            t[i] = (wchar_t)(b[12 + i * 2] | (b[13 + i * 2] << 8));
+    }
+    else {
+        int wn = MultiByteToWideChar(CP_UTF8, 0, (const char *)b + 10, -1, 0, 0);
+        t = xwalloc(wn + 1);
+        MultiByteToWideChar(CP_UTF8, 0, (const char *)b + 10, -1, t, wn);
+    }
+    if (*t == L'\0') {
+        xfree(t);
+        return 0;
+    }
+    return t;
+}
+
+/**
+ * Returns Windows path of the link target from
+ * the per-thread cache, reading the link on miss.
+ * The result is valid until the next call.
+ */
+static const wchar_t *linktarget(const wchar_t *path)
+{
+    int i;
+    DWORD n;
+    wchar_t   *t;
+    wchar_t   *w;
+    linkent_t *e;
+
+    for (i = 0; i < P2W_LINK_CACHE; i++) {
+        e = &linkcache[i];
+        if (e->path == 0)
+            break;
+        if (_wcsicmp(e->path, path) == 0)
+            return e->target;
+    }
+    e = &linkcache[linknext++ % P2W_LINK_CACHE];
+    xfree(e->path);
+    xfree(e->target);
+    e->path   = xwcsdup(path);
+    e->target = 0;
+    if ((t = readlinkfile(path)) == 0)
+        return 0;
+    if (t[0] == L'/') {
+        int m = 0;
+        int b = P2W_BRANCH_NONE;
+
+        /* Same drive rules as for the arguments */
+        w = xposix2win(t, &m, &b);
+        if (w[0] == L'/') {
+            /* Not converted, the target is under posix root */
+            xwinpathsep(w);
+            t = xwcsconcat(posixroot, w);
+            xfree(w);
+            w = t;
+        }
+    }
+    else {
+        /* Relative to the directory containing the link */
+        xwinpathsep(t);
+        w = xwcsnconcat(path, (size_t)(wcsrchr(path, L'\\') - path + 1), t);
+        xfree(t);
+    }
+    n = GetFullPathNameW(w, 0, 0, 0);
+    if (n != 0) {
+        e->target = xwalloc(n + 1);
+        if (GetFullPathNameW(w, n, e->target, 0) == 0) {
+            xfree(e->target);
+            e->target = 0;
+        }
+    }
+    xfree(w);
+    return e->target;
+}
+
+/**
+ * Release the per-thread link cache
+ */
+static void linkfree(void)
+{
+    int i;
+
+    for (i = 0; i < P2W_LINK_CACHE; i++) {
+        xfree(linkcache[i].path);
+        xfree(linkcache[i].target);
+        linkcache[i].path   = 0;
+        linkcache[i].target = 0;
+    }
+    linknext = 0;
+}
+
+/**
+ * Follow symlinks inside the path located under posix root.
+ * Each path prefix is checked starting from the root.
+ * When a link is replaced the scan restarts, so that
+ * links inside the target are resolved as well.
+ */
+static wchar_t *resolvepath(wchar_t *wp)
+{
+    int      loops = 0;
+    size_t   rl = wcslen(posixroot);
+    wchar_t *s  = wp + rl;
+
+    while (*s == L'\\') {
+        wchar_t *e = wcschr(s + 1, L'\\');
+        wchar_t *r;
+        wchar_t  c;
+        const wchar_t *t;
+
+        if (e == 0)
+            e = s + wcslen(s);
+        c  = *e;
+        *e = L'\0';
+        t  = linktarget(wp);
+        *e = c;
+        if (t == 0) {
+            s = e;
+            continue;
+        }
+        if (++loops > P2W_LINK_LOOPS)
+            break;
+        r = xwcsconcat(t, e);
+        xfree(wp);
+        wp = r;
+        if (_wcsnicmp(wp, posixroot, rl) != 0) {
+            /* Target is outside posix root */
+            break;
+        }
+        s = wp + rl;
+    }
+    return wp;
+}
+
+static wchar_t *posix2win(wchar_t *pp)
+{
+    int m = 0;
+    int b = P2W_BRANCH_NONE;
+    LONGLONG t;
+    wchar_t *rv;
+
+    t  = tracefile ? traceticks() : 0;
+    rv = xposix2win(pp, &m, &b);
+    if (resolvelinks && (b == P2W_BRANCH_PREFIX))
+        rv = resolvepath(rv);
+    if (tracefile != 0)
+        traceadd(m, b, rv, traceticks() - t);
+    return rv;
+}
+
+static unsigned __int64 cachehash(unsigned __int64 h, const wchar_t *s, size_t n)
+{
+    size_t i;
+
+    /* FNV-1a */
+    for (i = 0; i < n; i++) {
+        h ^= s[i];
+        h *= 0x100000001B3ULL;
+    }
+    return h;
+}
+
+/**
+ * Map the shared cache. On any failure posix2wx
+ * simply runs without it.
+ */
+static void cacheinit(void)
+{
+    HANDLE m;
+    void  *p;
+
+    m = CreateFileMappingW(INVALID_HANDLE_VALUE, 0, PAGE_READWRITE,
+                           0, P2W_CACHE_SIZE, P2W_CACHE_NAME);
+    if (m == 0)
+        return;
+    if ((p = MapViewOfFile(m, FILE_MAP_ALL_ACCESS, 0, 0, 0)) == 0) {
+        CloseHandle(m);
+        return;
+    }
+    /**
+     * Keep the mapping handle open for the process
+     * lifetime so that concurrent processes share it.
+     * Cached values depend on the posix root.
+     */
+    cachemap   = (cachehdr_t *)p;
+    cacheslots = (cacheslot_t *)(cachemap + 1);
+    cachesize  = (P2W_CACHE_SIZE - sizeof(cachehdr_t)) / sizeof(cacheslot_t);
+    cacheseed  = cachehash(0xCBF29CE484222325ULL, posixroot, wcslen(posixroot) + 1);
+    if (resolvelinks)
+        cacheseed = cachehash(cacheseed, L"-s", 2);
+}
+
+static wchar_t *cacheget(const wchar_t *s, size_t n, unsigned __int64 h)
+{
+    size_t i;
+    size_t x = (size_t)(h % cachesize);
+
+    for (i = 0; i < P2W_CACHE_PROBE; i++) {
+        wchar_t *rv;
+        cacheslot_t *c = &cacheslots[(x + i) % cachesize];
+        LONG seq  = SLOT_SEQ(c->state);
+        size_t vn = c->vlen;
+
+        MemoryBarrier();
+        if (seq == 0 || (seq & 1))
+            continue;
+        if (c->hash != h || c->klen != n || n + vn > P2W_CACHE_CHARS)
+            continue;
+        if (wmemcmp(c->data, s, n) != 0)
+            continue;
+        rv = xwalloc(vn + 2);
+        wmemcpy(rv, c->data + n, vn);
+        MemoryBarrier();
+        if (SLOT_SEQ(c->state) != seq ||
+            c->check != cachehash(cachehash(h, s, n), rv, vn)) {
+            /* Slot was replaced or overwritten while reading */
+            xfree(rv);
+            continue;
+        }
+        InterlockedIncrement(&cachemap->hits);
+        return rv;
+    }
+    InterlockedIncrement(&cachemap->misses);
+    return 0;
+}
+
+/**
+ * Insert the value into the first empty slot or
+ * replace the oldest one inside the probe window.
+ * If another process owns the slot the value is
+ * not cached.
+ */
+static void cacheput(const wchar_t *s, size_t n, unsigned __int64 h, const wchar_t *v)
+{
+    size_t i;
+    size_t x  = (size_t)(h % cachesize);
+    size_t vn = wcslen(v);
+    LONG   seq, stamp;
+    LONGLONG st;
+    cacheslot_t *c = 0;
+
+    if (n + vn > P2W_CACHE_CHARS)
+        return;
+    for (i = 0; i < P2W_CACHE_PROBE; i++) {
+        cacheslot_t *p = &cacheslots[(x + i) % cachesize];
+
+        st  = p->state;
+        seq = SLOT_SEQ(st);
+        if (seq == 0) {
+            c = p;
+            break;
+        }
+        if (seq & 1) {
+            if ((cachemap->clock - SLOT_STAMP(st)) > P2W_CACHE_STALE) {
+                /* Abandoned by the writer */
+                c = p;
+                break;
+            }
+            continue;
+        }
+        if (p->hash == h && p->klen == n)
+            return;
+        if (c == 0 || (SLOT_STAMP(st) - SLOT_STAMP(c->state)) < 0)
+            c = p;
+    }
+    if (c == 0)
+        return;
+    st  = c->state;
+    seq = SLOT_SEQ(st);
+    if ((seq & 1) && (cachemap->clock - SLOT_STAMP(st)) <= P2W_CACHE_STALE)
+        return;
+    /**
+     * Claim the slot with odd sequence and fresh stamp
+     */
+    seq   = (seq | 1) + 2;
+    stamp = InterlockedIncrement(&cachemap->clock);
+    if (InterlockedCompareExchange64(&c->state, SLOT_STATE(seq, stamp), st) != st)
+        return;
+    c->hash  = h;
+    c->check = cachehash(cachehash(h, s, n), v, vn);
+    c->klen  = (unsigned short)n;
+    c->vlen  = (unsigned short)vn;
+    wmemcpy(c->data, s, n);
+    wmemcpy(c->data + n, v, vn);
+    MemoryBarrier();
+    /**
+     * Fails if the slot was reclaimed meanwhile
+     */
+    InterlockedCompareExchange64(&c->state, SLOT_STATE(seq + 1, stamp),
+                                 SLOT_STATE(seq, stamp));
+}
+
 static wchar_t *convert2win(const wchar_t *str)
 {
     wchar_t *wp;
@@ -529,15 +1188,37 @@ static wchar_t *convert2win(const wchar_t *str)
     if ((*str == L'\'') || (wcschr(str, L'/') == 0))
         return 0;
     if (iswinpath(str)) {
+        LONGLONG t = tracefile ? traceticks() : 0;
         wp = xwcsdup(str);
         xwinpathsep(wp);
+        if (tracefile != 0) {
+            tracectx.token = 0;
+            traceadd(0, P2W_BRANCH_WINPATH, wp, traceticks() - t);
+        }
     }
     else {
         int i, n;
-        wchar_t **pa = splitpath(str, &n);
+        wchar_t **pa;
+        size_t sn = 0;
+        unsigned __int64 h = 0;
+
+        if (cachemap != 0) {
+            LONGLONG t = tracefile ? traceticks() : 0;
+            sn = wcslen(str);
+            h  = cachehash(cacheseed, str, sn);
+            if ((wp = cacheget(str, sn, h)) != 0) {
+                if (tracefile != 0) {
+                    tracectx.token = 0;
+                    traceadd(0, P2W_BRANCH_CACHED, wp, traceticks() - t);
+                }
+                return wp;
+            }
+        }
+        pa = splitpath(str, &n);
 
         for (i = 0; i < n; i++) {
             wchar_t *e = pa[i];
+            tracectx.token = (unsigned char)i;
             pa[i] = posix2win(e);
             if (pa[i] == e) {
                break;
@@ -546,10 +1227,38 @@ static wchar_t *convert2win(const wchar_t *str)
         }
         wp = mergepath(pa);
         waafree(pa);
+        if (cachemap != 0)
+            cacheput(str, sn, h, wp);
     }
     return wp;
 }
 
+/**
+ * Convert single command line argument.
+ * Returns newly allocated string or zero if the
+ * argument does not need to be converted.
+ */
+static wchar_t *convertarg(const wchar_t *a)
+{
+    wchar_t *p;
+    wchar_t *r;
+    const wchar_t *v;
+
+    if ((wcschr(a, L'/') == 0) || (wcslen(a) < 4))
+        return 0;
+    v = cmdoptionval(a);
+    /* Offset is relative to the one set by tracesource */
+    if (!IS_EMPTY_WCS(v))
+        tracectx.offset += (unsigned int)(v - a);
+    if (IS_EMPTY_WCS(v))
+        return convert2win(a);
+    if ((p = convert2win(v)) == 0)
+        return 0;
+    r = xwcsnconcat(a, (size_t)(v - a), p);
+    xfree(p);
+    return r;
+}
+
 static wchar_t *getposixroot(wchar_t *r)
 {
 
@@ -581,12 +1290,493 @@ static void __cdecl xstdinrw(void *p)
     }
 }
 
-static int posixmain(int argc, wchar_t **wargv, int envc, wchar_t **wenvp)
+typedef struct rwchunk_t {
+    const char *b;      /* Chunk start inside the mapped file */
+    const char *e;
+    char       *out;
+    size_t      len;
+    size_t      size;
+    const char *fp;     /* Start of the mapped file */
+    int         json;
+    int         depfile;
+    int         index;
+} rwchunk_t;
+
+static void rwappend(rwchunk_t *c, const char *s, size_t n)
+{
+    if (c->len + n > c->size) {
+        c->size = (c->len + n) * 2;
+        c->out  = (char *)xrealloc(c->out, c->size);
+    }
+    memcpy(c->out + c->len, s, n);
+    c->len += n;
+}
+
+/**
+ * Convert single token using command line argument
+ * rules and append the result to the chunk output
+ */
+static void rwtoken(rwchunk_t *c, const char *s, int n)
+{
+    wchar_t  wb[P2W_TOKEN_SIZE];
+    wchar_t *ws = wb;
+    wchar_t *wp;
+    int      i, wn;
+    int      colon = 0;
+
+    if (memchr(s, '/', n) == 0) {
+        rwappend(c, s, n);
+        return;
+    }
+    if (c->depfile && n > 1 && s[n - 1] == ':') {
+        /* Keep the make target separator out of the path */
+        colon = 1;
+        n--;
+    }
+    tracesource('f', c->index, (int)(s - c->fp));
+    if (n >= P2W_TOKEN_SIZE)
+        ws = xwalloc(n + 1);
+    wn = MultiByteToWideChar(CP_UTF8, 0, s, n, ws, n);
+    ws[wn] = L'\0';
+    if (c->json) {
+        wchar_t *d = ws;
+        /* Unescape backslashes. They are escaped again on output */
+        for (i = 0; i < wn; i++) {
+            if (ws[i] == L'\\' && ws[i + 1] == L'\\')
+                i++;
+            *(d++) = ws[i];
+        }
+        *d = L'\0';
+    }
+    if (c->depfile) {
+        wchar_t *d = ws;
+        /* Unescape spaces. They are escaped again on output */
+        for (i = 0; i < wn; i++) {
+            if (ws[i] == L'\\' && ws[i + 1] == L' ')
+                i++;
+            *(d++) = ws[i];
+        }
+        *d = L'\0';
+    }
+    if (wn == 0 || (wp = convertarg(ws)) == 0) {
+        rwappend(c, s, n);
+    }
+    else {
+        char *mb;
+        char *b;
+
+        wn = WideCharToMultiByte(CP_UTF8, 0, wp, -1, 0, 0, 0, 0);
+        mb = (char *)xmalloc(wn + 1);
+        wn = WideCharToMultiByte(CP_UTF8, 0, wp, -1, mb, wn, 0, 0);
+        for (b = mb, i = 0; mb[i] != '\0'; i++) {
+            if (c->json && mb[i] == '\\') {
+                /* Escape backslashes inside JSON strings */
+                rwappend(c, b, (size_t)(mb + i + 1 - b));
+                b = mb + i;
+            }
+            else if (c->depfile && mb[i] == ' ') {
+                /* Escape spaces inside make dependency lists */
+                rwappend(c, b, (size_t)(mb + i - b));
+                rwappend(c, "\\", 1);
+                b = mb + i;
+            }
+        }
+        rwappend(c, b, (size_t)(mb + i - b));
+        xfree(mb);
+        xfree(wp);
+    }
+    if (ws != wb)
+        xfree(ws);
+    if (colon)
+        rwappend(c, ":", 1);
+}
+
+static unsigned __stdcall rwthread(void *arg)
+{
+    rwchunk_t  *c = (rwchunk_t *)arg;
+    const char *s = c->b;
+    const char *t;
+
+    c->size = (size_t)(c->e - c->b) + (size_t)(c->e - c->b) / 4 + 64;
+    c->out  = (char *)xmalloc(c->size);
+    while (s < c->e) {
+        for (t = s; t < c->e && !IS_TOKSEP(*t); t++) {
+            /* Escaped quote inside JSON string is not part of the token */
+            if (c->json && *t == '\\' && t + 1 < c->e && t[1] == '"')
+                break;
+            /* Escaped space inside dependency file is part of the token */
+            if (c->depfile && *t == '\\' && t + 1 < c->e && t[1] == ' ')
+                t++;
+        }
+        if (t > s) {
+            rwtoken(c, s, (int)(t - s));
+            s = t;
+        }
+        for (; t < c->e; t++) {
+            if (c->json && *t == '\\' && t + 1 < c->e && t[1] == '"')
+                t++;
+            else if (!IS_TOKSEP(*t))
+                break;
+        }
+        rwappend(c, s, (size_t)(t - s));
+        s = t;
+    }
+    linkfree();
+    return 0;
+}
+
+/**
+ * Map the whole file for reading.
+ * Returns zero on error or if the file is empty
+ * in which case *rc is zero as well.
+ */
+static const char *mapfile(const wchar_t *fn, size_t *size, int *rc)
+{
+    int    fd;
+    HANDLE mh;
+    const char *fp = 0;
+
+    *rc   = 0;
+    *size = 0;
+    if ((fd = _wopen(fn, _O_RDONLY | _O_BINARY)) == -1) {
+        *rc = errno;
+        fwprintf(stderr, L"Cannot open file: %s\nFatal error: %s\n\n",
+                 fn, _wcserror(*rc));
+        return 0;
+    }
+    *size = (size_t)_filelengthi64(fd);
+    if (*size == 0) {
+        _close(fd);
+        return 0;
+    }
+    mh = CreateFileMappingW((HANDLE)_get_osfhandle(fd), 0, PAGE_READONLY, 0, 0, 0);
+    if (mh == 0 || (fp = (const char *)MapViewOfFile(mh, FILE_MAP_READ, 0, 0, 0)) == 0) {
+        fwprintf(stderr, L"Cannot map file: %s\nFatal error: %d\n\n",
+                 fn, GetLastError());
+        *rc = EIO;
+    }
+    /**
+     * The view keeps the file mapped
+     */
+    if (mh != 0)
+        CloseHandle(mh);
+    _close(fd);
+    return fp;
+}
+
+/**
+ * Convert posix paths inside FILE and write
+ * the result to the standard output.
+ */
+static int rewritefile(const wchar_t *fn)
+{
+    int      i, n = 1;
+    int      rc = 0;
+    int      json, depfile;
+    size_t   fs, cs;
+    SYSTEM_INFO si;
+    const char *fp;
+    rwchunk_t  *ca;
+    HANDLE      th[MAXIMUM_WAIT_OBJECTS];
+
+    if ((fp = mapfile(fn, &fs, &rc)) == 0)
+        return rc;
+    GetSystemInfo(&si);
+    if (fs > P2W_CHUNK_SIZE) {
+        n = (int)si.dwNumberOfProcessors;
+        if (n > MAXIMUM_WAIT_OBJECTS)
+            n = MAXIMUM_WAIT_OBJECTS;
+        if ((size_t)n > fs / P2W_CHUNK_SIZE)
+            n = (int)(fs / P2W_CHUNK_SIZE);
+        if (n < 1)
+            n = 1;
+    }
+    cs   = fs / n;
+    json = wcslen(fn) > 5 && _wcsicmp(fn + wcslen(fn) - 5, L".json") == 0;
+    depfile = wcslen(fn) > 2 && _wcsicmp(fn + wcslen(fn) - 2, L".d") == 0;
+    ca = (rwchunk_t *)xmalloc(n * sizeof(rwchunk_t));
+    /**
+     * Split at line boundaries, or at token separator
+     * if the line is longer than the chunk
+     */
+    for (i = 0; i < n; i++) {
+        const char *e = fp + fs;
+
+        ca[i].b     = i == 0 ? fp : ca[i - 1].e;
+        ca[i].fp    = fp;
+        ca[i].json  = json;
+        ca[i].depfile = depfile;
+        ca[i].index = i;
+        if (i < n - 1) {
+            const char *p = fp + cs * (i + 1);
+            const char *l = p;
+
+            if (p < ca[i].b)
+                p = l = ca[i].b;
+            while (l < e && *l != '\n')
+                l++;
+            if (l >= e || (size_t)(l - p) > cs) {
+                while (p < e && (!IS_TOKSEP(*p) ||
+                                 (depfile && *p == ' ' && p[-1] == '\\')))
+                    p++;
+                l = p;
+            }
+            e = l < e ? l + 1 : e;
+        }
+        ca[i].e = e;
+    }
+    if (n == 1) {
+        th[0] = 0;
+        rwthread(&ca[0]);
+    }
+    else {
+        for (i = 0; i < n; i++) {
+            th[i] = (HANDLE)_beginthreadex(0, 0, rwthread, &ca[i], 0, 0);
+            if (th[i] == 0) {
+                /* Convert in this thread instead */
+                rwthread(&ca[i]);
+            }
+        }
+    }
+    _setmode(_fileno(stdout), _O_BINARY);
+    /**
+     * Write and release each chunk as soon as it
+     * and all the preceding chunks are converted
+     */
+    for (i = 0; i < n; i++) {
+        if (th[i] != 0) {
+            WaitForSingleObject(th[i], INFINITE);
+            CloseHandle(th[i]);
+        }
+        if (rc == 0 && fwrite(ca[i].out, 1, ca[i].len, stdout) != ca[i].len) {
+            rc = errno;
+            _wperror(L"Fatal error fwrite()");
+        }
+        xfree(ca[i].out);
+    }
+    fflush(stdout);
+    xfree(ca);
+    UnmapViewOfFile(fp);
+    return rc;
+}
+
+/**
+ * Load environment snapshot from NUL separated
+ * NAME=value list, terminated by the end of file or
+ * by an empty entry. UTF-16LE snapshots are used in
+ * place, UTF-8 ones are converted once.
+ * The mapping stays valid for the process lifetime.
+ */
+static const wchar_t **loadenv(const wchar_t *fn, int *envc, int *rc)
+{
+    int     i, n = 0;
+    size_t  fs, wn;
+    const char    *fp;
+    const wchar_t *ws;
+    const wchar_t *p;
+    const wchar_t **ea;
+
+    *envc = 0;
+    if ((fp = mapfile(fn, &fs, rc)) == 0 && *rc != 0)
+        return 0;
+    if (fs >= 2 && (unsigned char)fp[0] == 0xFF && (unsigned char)fp[1] == 0xFE) {
+        ws = (const wchar_t *)(fp + 2);
+        wn = (fs - 2) / sizeof(wchar_t);
+    }
+    else if (fs >= 2 && fp[0] != '\0' && fp[1] == '\0') {
+        ws = (const wchar_t *)fp;
+        wn = fs / sizeof(wchar_t);
+    }
+    else {
+        wchar_t *b;
+        wn = fs == 0 ? 0 : (size_t)MultiByteToWideChar(CP_UTF8, 0, fp, (int)fs, 0, 0);
+        b  = xwalloc(wn + 1);
+        if (wn > 0)
+            MultiByteToWideChar(CP_UTF8, 0, fp, (int)fs, b, (int)wn);
+        ws = b;
+    }
+    if (wn > 0 && ws[wn - 1] != L'\0') {
+        /**
+         * Last variable is not terminated
+         */
+        wchar_t *b = xwalloc(wn + 1);
+        wmemcpy(b, ws, wn);
+        ws = b;
+        wn++;
+    }
+    for (p = ws; p < ws + wn && *p != L'\0'; p += wcslen(p) + 1)
+        n++;
+    ea = (const wchar_t **)waalloc(n);
+    for (i = 0, p = ws; p < ws + wn && *p != L'\0'; p += wcslen(p) + 1) {
+        /* Skip entries without value */
+        if (wcschr(p + 1, L'=') != 0)
+            ea[i++] = p;
+    }
+    *envc = i;
+    return ea;
+}
+
+/**
+ * Check if the NAME= part of the variable is
+ * present in the environment array
+ */
+static int envexists(const wchar_t **ea, int envc, const wchar_t *p)
+{
+    int i;
+    size_t n;
+    const wchar_t *v = wcschr(p + 1, L'=');
+
+    if (v == 0)
+        return 0;
+    n = (size_t)(v - p) + 1;
+    for (i = 0; i < envc; i++) {
+        if (_wcsnicmp(ea[i], p, n) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+typedef struct p2wusage_t {
+    double            wall;     /* Milliseconds */
+    double            user;
+    double            system;
+    unsigned __int64  peakmem;  /* Peak working set in bytes */
+    unsigned __int64  rbytes;
+    unsigned __int64  wbytes;
+    unsigned __int64  obytes;
+} p2wusage_t;
+
+static double filetimems(const FILETIME *ft)
+{
+    ULARGE_INTEGER u;
+
+    u.LowPart  = ft->dwLowDateTime;
+    u.HighPart = ft->dwHighDateTime;
+    /* FILETIME is in 100ns units */
+    return (double)u.QuadPart / 10000.0;
+}
+
+static double tickms(LONGLONG ticks)
+{
+    LARGE_INTEGER f;
+
+    QueryPerformanceFrequency(&f);
+    return (double)ticks * 1000.0 / (double)f.QuadPart;
+}
+
+/**
+ * Collect resource usage of the finished child process
+ */
+static void childusage(HANDLE ph, p2wusage_t *u)
+{
+    FILETIME ct, et, kt, ut;
+    IO_COUNTERS io;
+    PROCESS_MEMORY_COUNTERS pm;
+
+    memset(u, 0, sizeof(p2wusage_t));
+    if (GetProcessTimes(ph, &ct, &et, &kt, &ut)) {
+        u->wall   = filetimems(&et) - filetimems(&ct);
+        u->user   = filetimems(&ut);
+        u->system = filetimems(&kt);
+    }
+    pm.cb = sizeof(pm);
+    if (GetProcessMemoryInfo(ph, &pm, sizeof(pm)))
+        u->peakmem = pm.PeakWorkingSetSize;
+    if (GetProcessIoCounters(ph, &io)) {
+        u->rbytes = io.ReadTransferCount;
+        u->wbytes = io.WriteTransferCount;
+        u->obytes = io.OtherTransferCount;
+    }
+}
+
+/**
+ * Return JSON string literal of s
+ */
+static char *jsonwcs(const wchar_t *s)
+{
+    char *b = (char *)xmalloc(wcslen(s) * 6 + 3);
+    char *p = b;
+
+    *(p++) = '"';
+    for (; *s != L'\0'; s++) {
+        if (*s == L'"' || *s == L'\\') {
+            *(p++) = '\\';
+            *(p++) = (char)*s;
+        }
+        else if (*s < 32 || *s > 126)
+            p += sprintf(p, "\\u%04x", (unsigned int)*s);
+        else
+            *(p++) = (char)*s;
+    }
+    *(p++) = '"';
+    *p = '\0';
+    return b;
+}
+
+/**
+ * Write single line JSON report to stderr
+ * or append it to the usagefile
+ */
+static void writeusage(const wchar_t *program, int rc, double convms, const p2wusage_t *u)
+{
+    char  *pj = jsonwcs(program);
+    char  *b;
+    int    n;
+    size_t bs = strlen(pj) + 2048;
+
+    b = (char *)xmalloc(bs);
+    n = _snprintf(b, bs - 1, "{\"program\":%s,\"exit\":%d,\"wall_ms\":%.3f,"
+                  "\"user_ms\":%.3f,\"system_ms\":%.3f,\"peak_working_set\":%I64u,"
+                  "\"read_bytes\":%I64u,\"write_bytes\":%I64u,\"other_bytes\":%I64u,"
+                  "\"convert_ms\":%.3f}\n",
+                  pj, rc, u->wall, u->user, u->system, u->peakmem,
+                  u->rbytes, u->wbytes, u->obytes, convms);
+    if (n < 0)
+        n = (int)(bs - 1);
+    b[n] = '\0';
+    if (wcscmp(usagefile, L"-") == 0) {
+        fputs(b, stderr);
+        fflush(stderr);
+    }
+    else {
+        HANDLE fh;
+        DWORD  wr;
+
+        /**
+         * Append only handle and single write keep the lines
+         * from concurrent processes sharing the usagefile intact
+         */
+        fh = CreateFileW(usagefile, FILE_APPEND_DATA,
+                         FILE_SHARE_READ | FILE_SHARE_WRITE, 0,
+                         OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, 0);
+        if (fh == INVALID_HANDLE_VALUE) {
+            fwprintf(stderr, L"Cannot open file: %s\nFatal error: %d\n\n",
+                     usagefile, GetLastError());
+        }
+        else {
+            WriteFile(fh, b, (DWORD)n, &wr, 0);
+            CloseHandle(fh);
+        }
+    }
+    xfree(b);
+    xfree(pj);
+}
+
+/**
+ * Arguments and environment variables are borrowed
+ * from the caller and replaced only when converted.
+ * Conversion starts at envx, the first environment
+ * variable that might contain a path.
+ */
+static int posixmain(int argc, wchar_t **wargv, int envc, wchar_t **wenvp, int envx)
 {
     int i, rc = 0;
     intptr_t rp;
     int orgstdin = -1;
     int stdinpipe[2];
+    int mode     = execmode;
+    double convms;
+    p2wusage_t cu;
 
 
 #if defined(_HAVE_DEBUG_OPTION)
@@ -601,37 +1791,23 @@ static int posixmain(int argc, wchar_t **wargv, int envc, wchar_t **wenvp)
         if (debug)
             wprintf(L"[%2d] : %s\n", i, a);
 #endif
-        if (wcschr(a, L'/') == 0)
-            continue;
-        if (wcslen(a) > 3) {
-            wchar_t *p;
-            wchar_t *v = cmdoptionval(a);
-            if (IS_EMPTY_WCS(v))
-                p = convert2win(a);
-            else
-                p = convert2win(v);
-            if (p != 0) {
-                if (IS_EMPTY_WCS(v))
-                    wargv[i] = p;
-                else {
-                    *v = L'\0';
-                    wargv[i] = xwcsconcat(a, p);
-                    xfree(p);
-                }
-                xfree(a);
+        tracesource('a', i, 0);
+        if ((a = convertarg(a)) != 0) {
+            wargv[i] = a;
 #if defined(_HAVE_DEBUG_OPTION)
-                if (debug)
-                    wprintf(L"     * %s\n", wargv[i]);
+            if (debug)
+                wprintf(L"     * %s\n", wargv[i]);
 #endif
-            }
         }
     }
 
 #if defined(_HAVE_DEBUG_OPTION)
-    if (debug)
+    if (debug) {
         wprintf(L"\nEnvironment variables (%d):\n", envc);
+        envx = 0;
+    }
 #endif
-    for (i = 0; i < (envc - 1); i++) {
+    for (i = envx; i < (envc - 1); i++) {
         wchar_t *p;
         wchar_t *e = wenvp[i];
 #if defined(_HAVE_DEBUG_OPTION)
@@ -642,10 +1818,9 @@ static int posixmain(int argc, wchar_t **wargv, int envc, wchar_t **wenvp)
             wchar_t *v = p + 1;
             if (wcschr(v, L'/') == 0)
                 continue;
+            tracesource('e', i, (int)(v - e));
             if ((wcslen(v) > 3) && ((p = convert2win(v)) != 0)) {
-                *v = L'\0';
-                wenvp[i] = xwcsconcat(e, p);
-                xfree(e);
+                wenvp[i] = xwcsnconcat(e, (size_t)(v - e), p);
                 xfree(p);
 #if defined(_HAVE_DEBUG_OPTION)
                 if (debug)
@@ -657,11 +1832,15 @@ static int posixmain(int argc, wchar_t **wargv, int envc, wchar_t **wenvp)
 #if defined(_HAVE_DEBUG_OPTION)
     if (debug) {
         wprintf(L"[%2d] : %s\n", i, wenvp[i]);
+        if (cachemap != 0)
+            wprintf(L"\nCache hits: %d, misses: %d\n",
+                    cachemap->hits, cachemap->misses);
+        wprintf(L"\nAllocations: %d\n", xallocs);
         return 0;
     }
 #endif
 
-    qsort((void *)wenvp, envc, sizeof(wchar_t *), envsort);
+    envsort(wenvp, envc);
 #if defined(_TEST_MODE)
     if (wcscmp(wargv[0], L"arg") == 0) {
         for (i = 1; i < argc; i++)
@@ -692,8 +1871,15 @@ static int posixmain(int argc, wchar_t **wargv, int envc, wchar_t **wenvp)
         }
         _close(stdinpipe[0]);
     }
+    if (usagefile != 0) {
+        /**
+         * Process handle is needed for accounting
+         */
+        mode = _P_NOWAIT;
+    }
     _flushall();
-    rp = _wspawnvpe(execmode, wargv[0], wargv, wenvp);
+    convms = tickms(traceticks() - starttime);
+    rp = _wspawnvpe(mode, wargv[0], wargv, wenvp);
     if (rp == (intptr_t)-1) {
         rc = errno;
         fwprintf(stderr, L"Cannot execute program: %s\nFatal error: %s\n\n",
@@ -711,12 +1897,21 @@ static int posixmain(int argc, wchar_t **wargv, int envc, wchar_t **wenvp)
         /* Create stdin R/W thread */
         stdinpipe[0] = _fileno(stdin);
         _beginthread(xstdinrw, 0, (void *)stdinpipe);
+    }
+    if (mode == _P_NOWAIT) {
+        if (usagefile != 0) {
+            /* _cwait closes the process handle */
+            WaitForSingleObject((HANDLE)rp, INFINITE);
+            childusage((HANDLE)rp, &cu);
+        }
         if (_cwait(&rc, rp, _WAIT_CHILD) == (intptr_t)-1) {
             rc = errno;
             fwprintf(stderr, L"Execute failed: %s\nFatal error: %s\n\n",
                     wargv[0], _wcserror(rc));
             return usage(rc);
         }
+        if (usagefile != 0)
+            writeusage(wargv[0], rc, convms, &cu);
     }
 
 #endif
@@ -730,13 +1925,22 @@ int wmain(int argc, const wchar_t **wargv, const wchar_t **wenv)
     wchar_t **dupwenvp = 0;
     wchar_t *crp       = 0;
     wchar_t *cwd       = 0;
-    wchar_t *opath;
+    wchar_t *trf       = 0;
+    wchar_t *rwf       = 0;
+    wchar_t *envf      = 0;
+    wchar_t *opath     = 0;
+    const wchar_t **senv = 0;
     wchar_t  nnp[4]    = { L'\0', L'\0', L'\0', L'\0' };
     int dupenvc = 0;
     int dupargc = 0;
     int envc    = 0;
+    int envx    = -1;
     int opts    = 1;
+    int cache   = 0;
+    int merge   = 0;
+    int senvc   = 0;
 
+    starttime = traceticks();
     if (argc < 2)
         return usage(1);
     if (wenv == 0)
@@ -762,6 +1966,22 @@ int wmain(int argc, const wchar_t **wargv, const wchar_t **wenv)
                 crp = xwcsdup(p);
                 continue;
             }
+            if (trf == nnp) {
+                trf = xwcsdup(p);
+                continue;
+            }
+            if (rwf == nnp) {
+                rwf = xwcsdup(p);
+                continue;
+            }
+            if (envf == nnp) {
+                envf = xwcsdup(p);
+                continue;
+            }
+            if (usagefile == nnp) {
+                usagefile = xwcsdup(p);
+                continue;
+            }
 
             if (p[0] == L'-') {
                 if (p[1] == L'\0' || p[2] != L'\0')
@@ -771,21 +1991,49 @@ int wmain(int argc, const wchar_t **wargv, const wchar_t **wenv)
                     case L'A':
                         execmode = _P_NOWAIT;
                     break;
+                    case L'c':
+                    case L'C':
+                        cache = 1;
+                    break;
 #if defined(_HAVE_DEBUG_OPTION)
                     case L'd':
                     case L'D':
                         debug = 1;
                     break;
 #endif
+                    case L'e':
+                    case L'E':
+                        envf = nnp;
+                    break;
+                    case L'f':
+                    case L'F':
+                        rwf = nnp;
+                    break;
                     case L'h':
                     case L'H':
                     case L'?':
                         return usage(0);
                     break;
+                    case L'm':
+                    case L'M':
+                        merge = 1;
+                    break;
                     case L'r':
                     case L'R':
                         crp = nnp;
                     break;
+                    case L's':
+                    case L'S':
+                        resolvelinks = 1;
+                    break;
+                    case L't':
+                    case L'T':
+                        trf = nnp;
+                    break;
+                    case L'u':
+                    case L'U':
+                        usagefile = nnp;
+                    break;
                     case L'v':
                     case L'V':
                         return version();
@@ -802,17 +2050,13 @@ int wmain(int argc, const wchar_t **wargv, const wchar_t **wenv)
             }
             opts = 0;
         }
-        dupwargv[dupargc++] = xwcsdup(p);
+        dupwargv[dupargc++] = (wchar_t *)p;
     }
-    if ((cwd == nnp) || (crp == nnp)) {
+    if ((cwd == nnp) || (crp == nnp) || (trf == nnp) || (rwf == nnp) ||
+        (envf == nnp) || (usagefile == nnp)) {
         fputs("Missing required parameter value\n\n", stderr);
         return usage(1);
     }
-    if ((opath = xgetenv(L"PATH")) == 0) {
-        fputs("Missing PATH environment variable\n\n", stderr);
-        return usage(1);
-    }
-    rmtrailingsep(opath);
     if ((posixroot = getposixroot(crp)) == 0) {
         fputs("Cannot determine POSIX_ROOT\n\n", stderr);
         return usage(1);
@@ -823,8 +2067,24 @@ int wmain(int argc, const wchar_t **wargv, const wchar_t **wenv)
                PROJECT_VERSION_STR, __DATE__ " " __TIME__);
     }
 #endif
+    if (cache)
+        cacheinit();
+    if (trf != 0) {
+        /**
+         * Enable tracing after the trace file name
+         * itself was converted
+         */
+        trf = posix2win(trf);
+        tracefile = trf;
+        atexit(tracedump);
+    }
+    if ((usagefile != 0) && (wcscmp(usagefile, L"-") != 0)) {
+        tracesource('u', 0, 0);
+        usagefile = posix2win(usagefile);
+    }
     if (cwd != 0) {
         rmtrailingsep(cwd);
+        tracesource('w', 0, 0);
         cwd = posix2win(cwd);
         if (_wchdir(cwd) != 0) {
             i = errno;
@@ -833,16 +2093,62 @@ int wmain(int argc, const wchar_t **wargv, const wchar_t **wenv)
             return usage(i);
         }
     }
+    if (rwf != 0) {
+        tracesource('f', 0, 0);
+        rwf = posix2win(rwf);
+        return rewritefile(rwf);
+    }
     while (wenv[envc] != 0) {
         if (IS_EMPTY_WCS(wenv[envc]))
             return invalidarg(L"empty environment variable");
         ++envc;
     }
+    if (envf != 0) {
+        tracesource('s', 0, 0);
+        envf = posix2win(envf);
+        if ((senv = loadenv(envf, &senvc, &i)) == 0)
+            return i;
+        for (i = 0; i < senvc; i++) {
+            if (strstartswith(senv[i], L"PATH=")) {
+                /**
+                 * PATH is added after the converted variables,
+                 * so convert the snapshot value here
+                 */
+                tracesource('e', i, 5);
+                if ((opath = convert2win(senv[i] + 5)) == 0)
+                    opath = xwcsdup(senv[i] + 5);
+                break;
+            }
+        }
+        if (merge == 0) {
+            /**
+             * Snapshot replaces current environment
+             */
+            wenv  = senv;
+            envc  = senvc;
+            senv  = 0;
+            senvc = 0;
+        }
+    }
+    if ((opath == 0) && ((envf == 0) || merge))
+        opath = xgetenv(L"PATH");
+    if (opath == 0) {
+        fputs("Missing PATH environment variable\n\n", stderr);
+        return usage(1);
+    }
+    rmtrailingsep(opath);
 
-    dupwenvp = waalloc(envc + 2);
-    for (i = 0; i < envc; i++) {
+    dupwenvp = waalloc(senvc + envc + 2);
+    for (i = 0; i < (senvc + envc); i++) {
         const wchar_t **e = removeenv;
-        const wchar_t *p  = wenv[i];
+        const wchar_t *p  = i < senvc ? senv[i] : wenv[i - senvc];
+
+        if ((i >= senvc) && envexists(senv, senvc, p)) {
+            /**
+             * Snapshot overrides current variable
+             */
+            continue;
+        }
 
         while (*e != 0) {
             if (strstartswith(p, *e)) {
@@ -854,8 +2160,17 @@ int wmain(int argc, const wchar_t **wargv, const wchar_t **wenv)
             }
             e++;
         }
-        if (p != 0)
-            dupwenvp[dupenvc++] = xwcsdup(p);
+        if (p != 0) {
+            if ((envx < 0) && (wcschr(p, L'/') != 0))
+                envx = dupenvc;
+            dupwenvp[dupenvc++] = (wchar_t *)p;
+        }
+    }
+    if (envx < 0) {
+        /**
+         * Nothing to convert
+         */
+        envx = dupenvc;
     }
 
     /**
@@ -864,5 +2179,5 @@ int wmain(int argc, const wchar_t **wargv, const wchar_t **wenv)
     dupwenvp[dupenvc++] = xwcsconcat(L"PATH=", opath);
     xfree(opath);
 
-    return posixmain(dupargc, dupwargv, dupenvc, dupwenvp);
+    return posixmain(dupargc, dupwargv, dupenvc, dupwenvp, envx);
 }
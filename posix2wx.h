@@ -47,5 +47,55 @@
   "See the License for the specific language governing permissions and "        \
   "limitations under the License."
 
+/**
+ * Conversion trace dump format.
+ *
+ * The file starts with p2wtrace_hdr_t followed by
+ * hdr.count p2wtrace_rec_t records, oldest first.
+ * Values are stored in native (little endian) byte order.
+ */
+#define P2W_TRACE_MAGIC         0x57325850  /* "PX2W" */
+#define P2W_TRACE_VERSION       2
+#define P2W_TRACE_SIZE          4096        /* Must be power of two */
+
+/**
+ * Which branch of posix2win produced the result
+ */
+#define P2W_BRANCH_NONE         0   /* No path separator */
+#define P2W_BRANCH_NOTPOSIX     1   /* Not a posix path */
+#define P2W_BRANCH_WINPATH      2   /* Windows path separators only */
+#define P2W_BRANCH_CYGDRIVE     3   /* /cygdrive/x/... */
+#define P2W_BRANCH_MSYSDRIVE    4   /* /x/... */
+#define P2W_BRANCH_FOREIGN      5   /* /x/... not on posix root drive */
+#define P2W_BRANCH_DOTPATH      6   /* ./ or ../ */
+#define P2W_BRANCH_ROOT         7   /* / */
+#define P2W_BRANCH_DEVNULL      8   /* /dev/null */
+#define P2W_BRANCH_PREFIX       9   /* Prefixed with posix root */
+#define P2W_BRANCH_CACHED       10  /* Found in shared cache */
+
+#if !defined(RC_INVOKED)
+
+typedef struct p2wtrace_hdr_t {
+    unsigned int        magic;
+    unsigned int        version;
+    unsigned int        count;      /* Number of records that follow */
+    unsigned int        dropped;    /* Records lost by ring wrap */
+    unsigned __int64    frequency;  /* Tick frequency per second */
+} p2wtrace_hdr_t;
+
+typedef struct p2wtrace_rec_t {
+    unsigned char       source;     /* 'a'rgument, 'e'nvironment, 'w'orkdir, 'f'ile,
+                                       's'napshot or 'u'sage file name */
+    unsigned char       token;      /* Path token index inside the value */
+    unsigned short      item;       /* Argument, environment or chunk index */
+    unsigned int        offset;     /* Value offset inside the item or file */
+    unsigned short      match;      /* isposixpath match code */
+    unsigned short      length;     /* Output length in characters */
+    unsigned char       branch;     /* P2W_BRANCH_* */
+    unsigned char       reserved[3];
+    unsigned int        ticks;      /* Time spent in posix2win */
+} p2wtrace_rec_t;
+
+#endif /* RC_INVOKED */
 
 #endif /* _POSIX2WX_H_INCLUDED_ */